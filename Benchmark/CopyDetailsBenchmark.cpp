@@ -0,0 +1,491 @@
+/*
+ * CopyDetails - A tool to copy some properties and dates from one video file to another
+ * Copyright(C) 2018 Tamas Kezdi
+ *
+ * This program is free software : you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see < https://www.gnu.org/licenses/>.
+ */
+
+// The benchmark builds the whole program with another entry point, so it writes its corpus with the MP4 store
+// and runs CopyDetails.exe on it as a separate process for every mode
+#include "../CopyDetails.cpp"
+
+constexpr int cCorpusNameDigits = 6;
+constexpr DWORD cCorpusMaxItems = 16;
+constexpr DWORD cCorpusPaddings[] = {0, 512, 4096};
+constexpr ULONGLONG cCorpusEpoch = 126227808000000000ULL; // 2001-01-01
+constexpr BYTE cCorpusFtyp[] = {0, 0, 0, 20, 'f', 't', 'y', 'p', 'i', 's', 'o', 'm', 0, 0, 2, 0, 'i', 's', 'o', 'm'};
+constexpr int cDefaultBenchmarkRuns = 3;
+constexpr DWORD cChildOutputChunk = 64 * 1024;
+constexpr DWORD cBenchmarkPercentiles[] = {50, 90, 99};
+
+constexpr const wchar_t cBenchmarkUsage[] =
+	L"Usage:\n"
+	L"\n"
+	L"  CopyDetailsBenchmark.exe copydetails_exe corpus_dir count size_kb [runs]\n"
+	L"\n"
+	L"Writes count synthetic MP4 pairs with size_kb of media into corpus_dir\\sources and corpus_dir\\targets and\n"
+	L"runs copydetails_exe -mirror on them in each mode, 3 times by default. The sources hold up to 15 items of the\n"
+	L"built-in properties and vary their padding and whether the moov comes before or after the media. The targets\n"
+	L"have the same layout without the items, and are written again before every run.\n"
+	L"Each mode prints a JSON line with its pairs per second, the percentiles of the pair latency over all runs and\n"
+	L"the failed pairs and bytes the runs reported with -stats json.\n";
+
+constexpr const wchar_t cInvalidNumber[] = L"Invalid number: ";
+constexpr const wchar_t cCannotCreateDirectory[] = L"Cannot create directory: ";
+constexpr const wchar_t cCannotCreateFile[] = L"Cannot create file: ";
+constexpr const wchar_t cCannotRunProgram[] = L"Cannot run program: ";
+constexpr const wchar_t cCommandLineTooLong[] = L"Command line too long\n";
+constexpr const wchar_t cNoRunStats[] = L"No run stats from mode: ";
+constexpr const wchar_t *cCorpusDirectories[] = {L"\\targets", L"\\sources"};
+constexpr const wchar_t cCorpusExtension[] = L".mp4";
+constexpr const wchar_t cChildSwitches[] = L" -stats json -quiet";
+constexpr const wchar_t cChildMirrorSwitch[] = L" -mirror";
+constexpr const wchar_t cQuote[] = L"\"";
+constexpr const wchar_t cSpaceQuote[] = L" \"";
+constexpr const wchar_t cBenchmarkJsonStart[] = L"{\"mode\":\"";
+constexpr const wchar_t cBenchmarkJsonRuns[] = L"\",\"runs\":";
+constexpr const wchar_t *cBenchmarkFieldNames[] = {L"pairs", L"failed", L"pairs_per_second", L"bytes_read", L"bytes_written"};
+constexpr const wchar_t *cBenchmarkPercentileNames[] = {L"p50_us", L"p90_us", L"p99_us"};
+constexpr const wchar_t cBenchmarkMax[] = L"max_us";
+constexpr const char cPairLineStart[] = "{\"scope\":\"pair\"";
+constexpr const char cRunLineStart[] = "{\"scope\":\"run\"";
+constexpr const char cPairTime[] = "\"pair_us\":";
+constexpr const char cWallTime[] = "\"wall_us\":";
+constexpr const char *cPairCounterNames[] = {"\"failed\":", "\"bytes_read\":", "\"bytes_written\":"};
+
+// A way to run CopyDetails.exe, by the switches it adds to the command line
+struct BenchmarkMode
+{
+	const wchar_t *mName;
+	const wchar_t *mSwitches;
+};
+
+constexpr BenchmarkMode cBenchmarkModes[] = {
+	{L"shell", L""},
+	{L"shell_jobs", L" -jobs 0"},
+	{L"native", L" -native"},
+	{L"native_jobs", L" -native -jobs 0"},
+	{L"native_writers", L" -native -jobs 0 -writers 2"},
+	{L"dates", L" -copy_only_dates -jobs 0"},
+};
+
+// What the runs of a mode reported: the latency of every pair, and the counters summed over the runs
+struct BenchmarkResult
+{
+	HeapArray<ULONGLONG> mLatencies;
+	ULONGLONG mFailed;
+	ULONGLONG mBytesRead;
+	ULONGLONG mBytesWritten;
+	ULONGLONG mWallTime;
+	int mNumRuns;
+};
+
+const wchar_t *gProgramName;
+wchar_t gCorpusRoot[cMaxPath];
+int gCorpusRootLength;
+int gCorpusCount;
+ULONGLONG gCorpusMediaSize;
+wchar_t gCommandLine[32768];
+int gCommandLineLength;
+HeapArray<char> gChildOutput;
+
+// Writes a synthetic MP4: the ftyp, then the moov holding num_items own items and the padding, before or after an
+// mdat of media_size bytes, which are left to the zeros of the extended file
+bool WriteCorpusFile(const wchar_t *path, DWORD num_items, DWORD padding, bool moov_first, ULONGLONG media_size, const FILETIME &time)
+{
+	// The moov is built by the MP4 store from an empty one, so it has the layout the store reads back
+	Mp4PropertyStore *store = new Mp4PropertyStore;
+	if (nullptr == store)
+		return false;
+	store->mRefCount = 1;
+	store->mMoovSize = 8;
+	store->mMoov = static_cast<BYTE *>(HeapAlloc(GetProcessHeap(), 0, store->mMoovSize));
+	HRESULT result = E_OUTOFMEMORY;
+	BYTE *moov = nullptr;
+	DWORD moov_size = 0;
+	if (store->mMoov)
+	{
+		WriteU32(store->mMoov, store->mMoovSize);
+		WriteU32(store->mMoov + 4, cBoxMoov);
+		result = S_OK;
+		for (DWORD i = 0; i < num_items && SUCCEEDED(result); ++i)
+		{
+			NativeProperty *property = store->mProperties.Add(1);
+			if (nullptr == property)
+			{
+				result = E_OUTOFMEMORY;
+				break;
+			}
+			property->mKey = gPropertySet.mKeys[i];
+			property->mValue.vt = VT_UI4;
+			property->mValue.ulVal = i + 1;
+		}
+		if (SUCCEEDED(result))
+			result = store->BuildMoov(&moov, &moov_size);
+	}
+	store->Release();
+	if (FAILED(result))
+		return false;
+
+	HANDLE file = CreateFile(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	bool written = INVALID_HANDLE_VALUE != file;
+	if (written)
+	{
+		const ULONGLONG mdat_size = media_size + (0xFFFFFFFF - 8 >= media_size ? 8 : 16);
+		const ULONGLONG moov_offset = sizeof(cCorpusFtyp) + (moov_first ? 0 : mdat_size);
+		const ULONGLONG mdat_offset = moov_first ? moov_offset + moov_size + padding : sizeof(cCorpusFtyp);
+		LARGE_INTEGER end;
+		end.QuadPart = sizeof(cCorpusFtyp) + mdat_size + moov_size + padding;
+		written = WriteAt(file, 0, cCorpusFtyp, sizeof(cCorpusFtyp)) && WriteAt(file, moov_offset, moov, moov_size) &&
+			(0 == padding || WriteFreeBox(file, moov_offset + moov_size, padding)) && WriteBoxHeader(file, mdat_offset, mdat_size, cBoxMdat) &&
+			SetFilePointerEx(file, end, nullptr, FILE_BEGIN) && SetEndOfFile(file) && SetFileTime(file, &time, nullptr, &time);
+		CloseHandle(file);
+	}
+	HeapFree(GetProcessHeap(), 0, moov);
+	return written;
+}
+
+// Writes one tree of the corpus. File i of both trees has the same name and layout, the sources have i / 6 % 16
+// items and their own times, so every pair has something to copy. The paths are built in gMirrorPath
+bool WriteCorpusTree(int role)
+{
+	lstrcpyn(gMirrorPath, gCorpusRoot, gCorpusRootLength + 1);
+	lstrcpyn(gMirrorPath + gCorpusRootLength, cCorpusDirectories[role], GetNumElements(gMirrorPath) - gCorpusRootLength);
+	const int length = lstrlen(gMirrorPath);
+	if (length + 1 + cCorpusNameDigits + GetNumElements(cCorpusExtension) > cMaxPath)
+	{
+		PrintA(cPathTooLong);
+		PrintP(gMirrorPath);
+		PrintA(cNewLine);
+		return false;
+	}
+	if (!CreateDirectory(gMirrorPath, nullptr) && ERROR_ALREADY_EXISTS != GetLastError())
+	{
+		PrintA(cCannotCreateDirectory);
+		PrintP(gMirrorPath);
+		PrintA(cNewLine);
+		return false;
+	}
+
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	const DWORD num_items = cCorpusMaxItems - 1 < gPropertySet.mNumKeys ? cCorpusMaxItems - 1 : gPropertySet.mNumKeys;
+	wchar_t *name = gMirrorPath + length;
+	*name++ = '\\';
+	for (int i = 0; i < gCorpusCount; ++i)
+	{
+		DWORD number = i;
+		for (int j = cCorpusNameDigits - 1; j >= 0; --j, number /= 10)
+			name[j] = static_cast<wchar_t>(number % 10 + '0');
+		lstrcpyn(name + cCorpusNameDigits, cCorpusExtension, GetNumElements(cCorpusExtension));
+
+		ULARGE_INTEGER time;
+		time.QuadPart = cCorpusEpoch + MultiplyU64(i, 10000000);
+		FILETIME source_time = {time.LowPart, time.HighPart};
+		const DWORD item_count = static_cast<DWORD>(i / 6) % cCorpusMaxItems;
+		if (!WriteCorpusFile(gMirrorPath, FR_SRC == role ? (item_count < num_items ? item_count : num_items) : 0,
+			cCorpusPaddings[i / 2 % GetNumElements(cCorpusPaddings)], 0 == i % 2, gCorpusMediaSize, FR_SRC == role ? source_time : now))
+		{
+			PrintA(cCannotCreateFile);
+			PrintP(gMirrorPath);
+			PrintA(cNewLine);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool AppendCommandLine(const wchar_t *text)
+{
+	const int length = lstrlen(text);
+	if (GetNumElements(gCommandLine) <= gCommandLineLength + length)
+		return false;
+	lstrcpyn(gCommandLine + gCommandLineLength, text, length + 1);
+	gCommandLineLength += length;
+	return true;
+}
+
+// Builds the command line of a mode: "exe" -stats json -quiet <switches> -mirror "root\sources" "root\targets"
+bool BuildCommandLine(const BenchmarkMode &mode)
+{
+	gCommandLineLength = 0;
+	bool result = AppendCommandLine(cQuote) && AppendCommandLine(gProgramName) && AppendCommandLine(cQuote) &&
+		AppendCommandLine(cChildSwitches) && AppendCommandLine(mode.mSwitches) && AppendCommandLine(cChildMirrorSwitch);
+	for (int role = cMaxNumFiles - 1; result && role >= 0; --role)
+	{
+		result = AppendCommandLine(cSpaceQuote) && AppendCommandLine(gCorpusRoot) && AppendCommandLine(cCorpusDirectories[role]) &&
+			AppendCommandLine(cQuote);
+	}
+	if (!result)
+		PrintA(cCommandLineTooLong);
+	return result;
+}
+
+// Runs the command line with its output on a pipe, and keeps all of it in gChildOutput
+bool RunChild()
+{
+	gChildOutput.mSize = 0;
+	SECURITY_ATTRIBUTES security_attributes = {sizeof(security_attributes), nullptr, TRUE};
+	HANDLE read_pipe;
+	HANDLE write_pipe;
+	if (!CreatePipe(&read_pipe, &write_pipe, &security_attributes, 0))
+	{
+		PrintA(cCannotRunProgram);
+		PrintP(gProgramName);
+		PrintA(cNewLine);
+		return false;
+	}
+	// Only the write end goes to the child, or the pipe would never close
+	SetHandleInformation(read_pipe, HANDLE_FLAG_INHERIT, 0);
+
+	STARTUPINFO startup_info;
+	ZeroBytes(&startup_info, sizeof(startup_info));
+	startup_info.cb = sizeof(startup_info);
+	startup_info.dwFlags = STARTF_USESTDHANDLES;
+	startup_info.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	startup_info.hStdOutput = write_pipe;
+	startup_info.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+	PROCESS_INFORMATION process_information;
+	const bool started = CreateProcess(nullptr, gCommandLine, nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup_info, &process_information);
+	CloseHandle(write_pipe);
+	if (!started)
+	{
+		CloseHandle(read_pipe);
+		PrintA(cCannotRunProgram);
+		PrintP(gProgramName);
+		PrintA(cNewLine);
+		return false;
+	}
+
+	bool result = true;
+	for (;;)
+	{
+		char *chunk = gChildOutput.Add(cChildOutputChunk);
+		if (nullptr == chunk)
+		{
+			PrintA(cOutOfMemory);
+			result = false;
+			break;
+		}
+		DWORD read = 0;
+		const bool read_ok = ReadFile(read_pipe, chunk, cChildOutputChunk, &read, nullptr);
+		gChildOutput.mSize -= cChildOutputChunk - read;
+		if (!read_ok || 0 == read)
+			break;
+	}
+	CloseHandle(read_pipe);
+	WaitForSingleObject(process_information.hProcess, INFINITE);
+	CloseHandle(process_information.hProcess);
+	CloseHandle(process_information.hThread);
+	return result;
+}
+
+bool StartsWith(const char *line, DWORD length, const char *prefix)
+{
+	const DWORD prefix_length = lstrlenA(prefix);
+	if (length < prefix_length)
+		return false;
+	for (DWORD i = 0; i < prefix_length; ++i)
+	{
+		if (line[i] != prefix[i])
+			return false;
+	}
+	return true;
+}
+
+// Adds the number after the first occurrence of name, which holds the quotes and the colon, in a JSON line
+void AddJsonNumber(const char *line, DWORD length, const char *name, ULONGLONG *number)
+{
+	const DWORD name_length = lstrlenA(name);
+	for (DWORD i = 0; i + name_length <= length; ++i)
+	{
+		if (!StartsWith(line + i, length - i, name))
+			continue;
+		ULONGLONG value = 0;
+		for (i += name_length; i < length && '0' <= line[i] && '9' >= line[i]; ++i)
+			value = MultiplyU64(value, 10) + (line[i] - '0');
+		*number += value;
+		return;
+	}
+}
+
+// Takes the latency and counters of every pair line and the wall time of the run line of a run
+bool ParseChildOutput(BenchmarkResult &result)
+{
+	bool has_run = false;
+	const char *output = gChildOutput.mData;
+	DWORD start = 0;
+	while (start < gChildOutput.mSize)
+	{
+		DWORD end = start;
+		while (end < gChildOutput.mSize && '\n' != output[end])
+			++end;
+		const char *line = output + start;
+		const DWORD length = end - start;
+		if (StartsWith(line, length, cPairLineStart))
+		{
+			ULONGLONG *latency = result.mLatencies.Add(1);
+			if (nullptr == latency)
+			{
+				PrintA(cOutOfMemory);
+				return false;
+			}
+			*latency = 0;
+			AddJsonNumber(line, length, cPairTime, latency);
+			ULONGLONG *counters[] = {&result.mFailed, &result.mBytesRead, &result.mBytesWritten};
+			for (int i = 0; i < GetNumElements(counters); ++i)
+				AddJsonNumber(line, length, cPairCounterNames[i], counters[i]);
+		}
+		else if (StartsWith(line, length, cRunLineStart))
+		{
+			AddJsonNumber(line, length, cWallTime, &result.mWallTime);
+			has_run = true;
+		}
+		start = end + 1;
+	}
+	return has_run;
+}
+
+void SiftDown(ULONGLONG *values, DWORD parent, DWORD end)
+{
+	for (DWORD child = 2 * parent + 1; child < end; parent = child, child = 2 * parent + 1)
+	{
+		if (child + 1 < end && values[child] < values[child + 1])
+			++child;
+		if (values[parent] >= values[child])
+			return;
+		const ULONGLONG value = values[parent];
+		values[parent] = values[child];
+		values[child] = value;
+	}
+}
+
+// Heap sort, so the percentiles need nothing from the CRT
+void SortLatencies(ULONGLONG *values, DWORD count)
+{
+	for (DWORD i = count / 2; i-- > 0;)
+		SiftDown(values, i, count);
+	for (DWORD end = count; end-- > 1;)
+	{
+		const ULONGLONG value = values[0];
+		values[0] = values[end];
+		values[end] = value;
+		SiftDown(values, 0, end);
+	}
+}
+
+void PrintBenchmarkValue(const wchar_t *name, ULONGLONG value)
+{
+	PrintStatsName(name, cStatsEmpty);
+	PrintU64(value);
+}
+
+// Prints the mode as one JSON line of fixed members. The percentiles are nearest ranks over the pairs of all runs
+void PrintBenchmarkResult(const BenchmarkMode &mode, BenchmarkResult &result)
+{
+	const DWORD num_pairs = result.mLatencies.mSize;
+	SortLatencies(result.mLatencies.mData, num_pairs);
+	const ULONGLONG wall_milliseconds = DivideU64(result.mWallTime, 1000);
+	const ULONGLONG values[] = {num_pairs, result.mFailed,
+		DivideU64(MultiplyU64(num_pairs, 1000), wall_milliseconds ? static_cast<DWORD>(wall_milliseconds) : 1), result.mBytesRead, result.mBytesWritten};
+
+	PrintA(cBenchmarkJsonStart);
+	PrintP(mode.mName);
+	PrintA(cBenchmarkJsonRuns);
+	PrintN(result.mNumRuns);
+	for (int i = 0; i < GetNumElements(values); ++i)
+		PrintBenchmarkValue(cBenchmarkFieldNames[i], values[i]);
+	for (int i = 0; i < GetNumElements(cBenchmarkPercentiles); ++i)
+	{
+		const DWORD rank = static_cast<DWORD>(DivideU64(__emulu(num_pairs, cBenchmarkPercentiles[i]) + 99, 100));
+		PrintBenchmarkValue(cBenchmarkPercentileNames[i], rank ? result.mLatencies.mData[rank - 1] : 0);
+	}
+	PrintBenchmarkValue(cBenchmarkMax, num_pairs ? result.mLatencies.mData[num_pairs - 1] : 0);
+	PrintA(cStatsJsonEnd);
+}
+
+void BenchmarkEntry()
+{
+	gConsoleOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	DWORD console_mode;
+	gOutputIsConsole = GetConsoleMode(gConsoleOutput, &console_mode);
+	gStatsFormat = SF_JSON;
+
+	gArgV = CommandLineToArgvW(GetCommandLine(), &gArgC);
+	if (nullptr == gArgV)
+	{
+		PrintA(cCannotGetCommandLine);
+		ExitProgram(1);
+	}
+	if (5 > gArgC || 6 < gArgC)
+	{
+		PrintA(cBenchmarkUsage);
+		ExitProgram(1);
+	}
+
+	gProgramName = gArgV[1];
+	int numbers[] = {0, 0, cDefaultBenchmarkRuns};
+	for (int i = 3; i < gArgC; ++i)
+	{
+		// A corpus and a benchmark need at least one pair and one run, but the media may be empty
+		if (!ParseNumber(gArgV[i], &numbers[i - 3]) || (4 != i && 0 == numbers[i - 3]))
+		{
+			PrintA(cInvalidNumber);
+			PrintP(gArgV[i]);
+			PrintA(cNewLine);
+			ExitProgram(1);
+		}
+	}
+	gCorpusCount = numbers[0];
+	gCorpusMediaSize = MultiplyU64(numbers[1], 1024);
+	const int num_runs = numbers[2];
+
+	gCorpusRootLength = SetMirrorPath(gArgV[2]);
+	if (0 == gCorpusRootLength)
+		ExitProgram(1);
+	lstrcpyn(gCorpusRoot, gMirrorPath, gCorpusRootLength + 1);
+	if (!CreateDirectory(gCorpusRoot, nullptr) && ERROR_ALREADY_EXISTS != GetLastError())
+	{
+		PrintA(cCannotCreateDirectory);
+		PrintP(gCorpusRoot);
+		PrintA(cNewLine);
+		ExitProgram(1);
+	}
+	if (!WriteCorpusTree(FR_SRC))
+		ExitProgram(1);
+
+	// Every run starts from fresh targets, as a run leaves them with the details of their sources
+	bool succeeded = true;
+	for (int i = 0; i < GetNumElements(cBenchmarkModes) && succeeded; ++i)
+	{
+		BenchmarkResult result = {};
+		succeeded = BuildCommandLine(cBenchmarkModes[i]);
+		for (; succeeded && result.mNumRuns < num_runs; ++result.mNumRuns)
+		{
+			succeeded = WriteCorpusTree(FR_DEST) && RunChild();
+			if (succeeded && !ParseChildOutput(result))
+			{
+				PrintA(cNoRunStats);
+				PrintP(cBenchmarkModes[i].mName);
+				PrintA(cNewLine);
+				succeeded = false;
+			}
+		}
+		if (succeeded)
+			PrintBenchmarkResult(cBenchmarkModes[i], result);
+		result.mLatencies.Dispose();
+	}
+	gChildOutput.Dispose();
+	ExitProgram(succeeded ? 0 : 1);
+}
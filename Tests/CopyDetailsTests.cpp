@@ -0,0 +1,1386 @@
+/*
+ * CopyDetails - A tool to copy some properties and dates from one video file to another
+ * Copyright(C) 2018 Tamas Kezdi
+ *
+ * This program is free software : you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see < https://www.gnu.org/licenses/>.
+ */
+
+// The tests build the whole program with another entry point, so they can call anything it has
+#include "../CopyDetails.cpp"
+#include <propvarutil.h>
+
+constexpr int cMaxNumFakeFiles = 16;
+constexpr int cMaxNumTestFiles = 32;
+constexpr DWORD cMaxTestFileSize = 16384;
+constexpr DWORD cTestMediaSize = 64;
+constexpr DWORD cTestMoovSize = 60;
+constexpr ULONGLONG cTestDate = 131906709234567800ULL;
+constexpr DWORD cTestMkvVoidSize = 1500;
+constexpr DWORD cTestEbmlIdDocType = 0x4282;
+constexpr DWORD cTestMkvIdTimecodeScale = 0x2AD7B1;
+
+constexpr const wchar_t cTestDirectoryName[] = L"CopyDetailsTests";
+constexpr const wchar_t cTestFailed[] = L"Failed: ";
+constexpr const wchar_t cTestLine[] = L" line ";
+constexpr const wchar_t cTestSummary[] = L"Tests: ";
+constexpr const wchar_t cTestFailedSummary[] = L", failed: ";
+constexpr const wchar_t cCannotCreateTestDirectory[] = L"Cannot create the test directory\n";
+
+// A file of the fake backend. Its properties live in memory, and each open and commit is counted
+struct FakeFile
+{
+	wchar_t mPath[MAX_PATH];
+	HeapArray<NativeProperty> mProperties;
+	volatile LONG mReadOpens;
+	volatile LONG mWriteOpens;
+	volatile LONG mCommits;
+	// Read opens take this long, and write opens wait for the event when it is set
+	DWORD mReadDelay;
+	HANDLE mWriteGate;
+};
+
+// Property store of the fake backend, holding a copy of the properties of its file until Commit
+struct FakePropertyStore : NativePropertyStore
+{
+	FakeFile *mFakeFile;
+
+	HRESULT STDMETHODCALLTYPE Commit() override;
+};
+
+struct Test
+{
+	const wchar_t *mName;
+	void (*mRun)();
+};
+
+FakeFile gFakeFiles[cMaxNumFakeFiles];
+int gNumFakeFiles;
+wchar_t gTestFilePaths[cMaxNumTestFiles][MAX_PATH];
+int gNumTestFiles;
+// Test files are built and read back here rather than in large stack arrays
+BYTE gTestFileData[cMaxTestFileSize];
+wchar_t gTestDirectory[MAX_PATH];
+int gTestDirectoryLength;
+
+const wchar_t *gTestName;
+int gNumTests;
+int gNumFailedTests;
+bool gTestFailed;
+
+void Check(bool condition, int line)
+{
+	if (condition)
+		return;
+	if (!gTestFailed)
+		++gNumFailedTests;
+	gTestFailed = true;
+	PrintA(cTestFailed);
+	PrintP(gTestName);
+	PrintA(cTestLine);
+	PrintN(line);
+	PrintA(cNewLine);
+}
+
+#define CHECK(condition) Check(condition, __LINE__)
+
+bool CopyProperties(HeapArray<NativeProperty> &destination, const HeapArray<NativeProperty> &source)
+{
+	for (DWORD i = 0; i < destination.mSize; ++i)
+		PropVariantClear(&destination.mData[i].mValue);
+	destination.mSize = 0;
+	if (0 == source.mSize)
+		return true;
+
+	NativeProperty *properties = destination.Add(source.mSize);
+	if (nullptr == properties)
+		return false;
+	for (DWORD i = 0; i < source.mSize; ++i)
+	{
+		properties[i].mKey = source.mData[i].mKey;
+		if (FAILED(PropVariantCopy(&properties[i].mValue, &source.mData[i].mValue)))
+			properties[i].mValue.vt = VT_EMPTY;
+	}
+	return true;
+}
+
+HRESULT FakePropertyStore::Commit()
+{
+	if (!mWritable)
+		return STG_E_ACCESSDENIED;
+	InterlockedIncrement(&mFakeFile->mCommits);
+	return CopyProperties(mFakeFile->mProperties, mProperties) ? S_OK : E_OUTOFMEMORY;
+}
+
+FakeFile *FindFakeFile(const wchar_t *file_path)
+{
+	for (int i = 0; i < gNumFakeFiles; ++i)
+	{
+		if (0 == lstrcmpi(gFakeFiles[i].mPath, file_path))
+			return &gFakeFiles[i];
+	}
+	return nullptr;
+}
+
+HRESULT OpenFakePropertyStore(const wchar_t *file_path, GETPROPERTYSTOREFLAGS flags, IPropertyStore **property_store)
+{
+	*property_store = nullptr;
+	FakeFile *fake_file = FindFakeFile(file_path);
+	if (nullptr == fake_file)
+		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+
+	const bool writable = 0 != (GPS_READWRITE & flags);
+	if (writable)
+	{
+		InterlockedIncrement(&fake_file->mWriteOpens);
+		if (fake_file->mWriteGate)
+			WaitForSingleObject(fake_file->mWriteGate, INFINITE);
+	}
+	else
+	{
+		InterlockedIncrement(&fake_file->mReadOpens);
+		if (fake_file->mReadDelay)
+			Sleep(fake_file->mReadDelay);
+	}
+
+	FakePropertyStore *fake_property_store = new FakePropertyStore;
+	if (nullptr == fake_property_store)
+		return E_OUTOFMEMORY;
+	fake_property_store->mRefCount = 1;
+	fake_property_store->mFilePath = file_path;
+	fake_property_store->mWritable = writable;
+	fake_property_store->mFakeFile = fake_file;
+	if (!CopyProperties(fake_property_store->mProperties, fake_file->mProperties))
+	{
+		fake_property_store->Release();
+		return E_OUTOFMEMORY;
+	}
+	*property_store = fake_property_store;
+	return S_OK;
+}
+
+constexpr PropertyStoreBackend gFakePropertyStoreBackend = {OpenFakePropertyStore};
+
+// Makes the full path of a file in the test directory, named by a letter and a number
+void GetTestPath(wchar_t *path, wchar_t letter, int number)
+{
+	lstrcpyn(path, gTestDirectory, gTestDirectoryLength + 1);
+	path[gTestDirectoryLength] = letter;
+	path[gTestDirectoryLength + 1] = static_cast<wchar_t>('0' + number / 10);
+	path[gTestDirectoryLength + 2] = static_cast<wchar_t>('0' + number % 10);
+	path[gTestDirectoryLength + 3] = 0;
+}
+
+// Creates a file in the test directory, which is deleted after the test
+const wchar_t *CreateTestFile(wchar_t letter, int number, const void *data, DWORD size)
+{
+	wchar_t *path = gTestFilePaths[gNumTestFiles++];
+	GetTestPath(path, letter, number);
+	const HANDLE file = CreateFile(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	CHECK(INVALID_HANDLE_VALUE != file);
+	if (INVALID_HANDLE_VALUE == file)
+		return path;
+	CHECK(0 == size || WriteAt(file, 0, data, size));
+	CloseHandle(file);
+	return path;
+}
+
+// Reads a whole test file into the buffer, and returns its size, or 0 when it does not fit
+DWORD ReadTestFile(const wchar_t *path, BYTE *buffer, DWORD capacity)
+{
+	const HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (INVALID_HANDLE_VALUE == file)
+		return 0;
+	LARGE_INTEGER size;
+	const bool read = GetFileSizeEx(file, &size) && capacity >= size.QuadPart && ReadAt(file, 0, buffer, static_cast<DWORD>(size.QuadPart));
+	CloseHandle(file);
+	return read ? static_cast<DWORD>(size.QuadPart) : 0;
+}
+
+// Creates an empty file, whose times the pairs copy, and its properties in the fake backend
+FakeFile *CreateFakeFile(wchar_t letter, int number)
+{
+	FakeFile &fake_file = gFakeFiles[gNumFakeFiles++];
+	ZeroBytes(&fake_file, sizeof(fake_file));
+	const wchar_t *path = CreateTestFile(letter, number, nullptr, 0);
+	lstrcpyn(fake_file.mPath, path, GetNumElements(fake_file.mPath));
+	return &fake_file;
+}
+
+void DeleteTestFiles()
+{
+	for (int i = 0; i < gNumFakeFiles; ++i)
+	{
+		for (DWORD j = 0; j < gFakeFiles[i].mProperties.mSize; ++j)
+			PropVariantClear(&gFakeFiles[i].mProperties.mData[j].mValue);
+		gFakeFiles[i].mProperties.Dispose();
+	}
+	gNumFakeFiles = 0;
+	for (int i = 0; i < gNumTestFiles; ++i)
+		DeleteFile(gTestFilePaths[i]);
+	gNumTestFiles = 0;
+}
+
+void AddFakeProperty(FakeFile &fake_file, int index, const PROPVARIANT &value)
+{
+	NativeProperty *property = fake_file.mProperties.Add(1);
+	CHECK(nullptr != property);
+	if (nullptr == property)
+		return;
+	property->mKey = gDefaultPropertyTable.mKeys[index];
+	CHECK(SUCCEEDED(PropVariantCopy(&property->mValue, &value)));
+}
+
+// Gives the source a text and a number, the kinds of values most pairs have
+void AddSourceProperties(FakeFile &fake_file, int number)
+{
+	wchar_t sub_title[] = L"Sub title 00";
+	sub_title[GetNumElements(sub_title) - 3] = static_cast<wchar_t>('0' + number / 10);
+	sub_title[GetNumElements(sub_title) - 2] = static_cast<wchar_t>('0' + number % 10);
+	PROPVARIANT value = {};
+	value.vt = VT_LPWSTR;
+	value.pwszVal = sub_title;
+	AddFakeProperty(fake_file, GetPropertyIndex(2, 38), value);
+
+	value.vt = VT_UI4;
+	value.ulVal = 2000 + number;
+	AddFakeProperty(fake_file, GetPropertyIndex(2, 5), value);
+}
+
+// The pairs write the values in the order of gPropertySet, so they are matched by their keys
+bool EqualProperties(const FakeFile &fake_file1, const FakeFile &fake_file2)
+{
+	if (fake_file1.mProperties.mSize != fake_file2.mProperties.mSize)
+		return false;
+	for (DWORD i = 0; i < fake_file1.mProperties.mSize; ++i)
+	{
+		const NativeProperty &property1 = fake_file1.mProperties.mData[i];
+		DWORD j = 0;
+		while (j < fake_file2.mProperties.mSize && (property1.mKey.pid != fake_file2.mProperties.mData[j].mKey.pid ||
+			0 != CompareGuid(property1.mKey.fmtid, fake_file2.mProperties.mData[j].mKey.fmtid)))
+			++j;
+		if (fake_file2.mProperties.mSize == j ||
+			0 != PropVariantCompareEx(property1.mValue, fake_file2.mProperties.mData[j].mValue, PVCU_DEFAULT, PVCF_CASESENSITIVE))
+			return false;
+	}
+	return true;
+}
+
+// Begins and runs the job of a pair, serially or on the workers
+Job *RunTestPair(const FakeFile &source, const FakeFile &target)
+{
+	Job *job = BeginJob();
+	CHECK(SetFullPath(*job, FR_SRC, source.mPath));
+	CHECK(SetFullPath(*job, FR_DEST, target.mPath));
+	RunJob(job);
+	return job;
+}
+
+// Each pair opens the target for writing once and commits once, and a pair with nothing to change writes nothing
+void TestOneCommitPerPair()
+{
+	FakeFile &source = *CreateFakeFile('s', 0);
+	FakeFile &target = *CreateFakeFile('t', 0);
+	AddSourceProperties(source, 0);
+
+	Job *job = RunTestPair(source, target);
+	CHECK(JR_SUCCEEDED == job->mResult);
+	CHECK(job->mChanged);
+	CHECK(1 == source.mReadOpens);
+	CHECK(0 == source.mWriteOpens);
+	CHECK(0 == source.mCommits);
+	// The target is read once to find the changes, then written once
+	CHECK(1 == target.mReadOpens);
+	CHECK(1 == target.mWriteOpens);
+	CHECK(1 == target.mCommits);
+	CHECK(EqualProperties(source, target));
+
+	job = RunTestPair(source, target);
+	CHECK(JR_SUCCEEDED == job->mResult);
+	CHECK(!job->mChanged);
+	CHECK(2 == target.mReadOpens);
+	CHECK(1 == target.mWriteOpens);
+	CHECK(1 == target.mCommits);
+}
+
+// Stops the workers of a test and frees the ring, so the next test runs its pairs serially again
+void StopTestWorkers()
+{
+	if (nullptr == gJobs)
+		return;
+	FinishJobs();
+	for (DWORD i = 0; i < gNumJobs; ++i)
+	{
+		if (gJobs[i].mArena.mBase)
+			VirtualFree(gJobs[i].mArena.mBase, 0, MEM_RELEASE);
+		for (int j = 0; j < cMaxNumFiles; ++j)
+		{
+			if (gJobs[i].mFullPaths[j])
+				HeapFree(GetProcessHeap(), 0, gJobs[i].mFullPaths[j]);
+		}
+	}
+	VirtualFree(gJobs, 0, MEM_RELEASE);
+	VirtualFree(gWorkers, 0, MEM_RELEASE);
+	CloseHandle(gJobsQueued);
+	if (gWritesQueued)
+		CloseHandle(gWritesQueued);
+	TlsFree(gJobOutputIndex);
+	gJobs = nullptr;
+	gWorkers = nullptr;
+	gJobsQueued = nullptr;
+	gWritesQueued = nullptr;
+	gNumJobs = 0;
+	gNextJob = 0;
+	gNextPrintedJob = 0;
+	gNumWorkers = 0;
+	gNumWriters = 0;
+	gWriteQueueStart = 0;
+	gWriteQueueSize = 0;
+	gStopWorkers = false;
+}
+
+// Pairs that finish out of order are still reported in the order they were begun
+void TestOrderedCompletion()
+{
+	constexpr int num_pairs = 8;
+	FakeFile *sources[num_pairs];
+	FakeFile *targets[num_pairs];
+	for (int i = 0; i < num_pairs; ++i)
+	{
+		sources[i] = CreateFakeFile('s', i);
+		targets[i] = CreateFakeFile('t', i);
+		AddSourceProperties(*sources[i], i);
+		// The first pairs take the longest to read
+		sources[i]->mReadDelay = (num_pairs - i) * 20;
+	}
+	CHECK(StartWorkers(4, 0, 0));
+	if (nullptr == gJobs)
+		return;
+
+	FlushOutput();
+	for (int i = 0; i < num_pairs; ++i)
+		RunTestPair(*sources[i], *targets[i]);
+	StopTestWorkers();
+
+	// The expected messages are printed after the actual ones, so the two halves of the buffer have to match
+	const DWORD output_length = gOutputLength;
+	for (int i = 0; i < num_pairs; ++i)
+	{
+		PrintA(cPairSucceeded);
+		PrintP(targets[i]->mPath);
+		PrintA(cNewLine);
+	}
+	CHECK(2 * output_length == gOutputLength &&
+		CSTR_EQUAL == CompareStringOrdinal(gOutput, output_length, gOutput + output_length, output_length, FALSE));
+	for (int i = 0; i < num_pairs; ++i)
+	{
+		CHECK(1 == targets[i]->mCommits);
+		CHECK(EqualProperties(*sources[i], *targets[i]));
+	}
+}
+
+// While the only writer is stuck, the workers read no more pairs than the writer, the write queue and the workers
+// themselves can hold, and once it goes on every pair is written once
+void TestQueueSaturation()
+{
+	constexpr int num_pairs = 6;
+	const HANDLE write_gate = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	CHECK(nullptr != write_gate);
+	FakeFile *sources[num_pairs];
+	FakeFile *targets[num_pairs];
+	for (int i = 0; i < num_pairs; ++i)
+	{
+		sources[i] = CreateFakeFile('s', i);
+		targets[i] = CreateFakeFile('t', i);
+		AddSourceProperties(*sources[i], i);
+		targets[i]->mWriteGate = write_gate;
+	}
+	// 2 workers, 1 writer and 1 queued write make a ring of 6 jobs, so all pairs are begun without waiting
+	CHECK(StartWorkers(2, 1, 1));
+	if (nullptr == gJobs)
+	{
+		CloseHandle(write_gate);
+		return;
+	}
+	for (int i = 0; i < num_pairs; ++i)
+		RunTestPair(*sources[i], *targets[i]);
+
+	// The writer holds a pair, one is queued, and each worker has read one it cannot queue
+	LONG num_reads = 0;
+	int num_stable_polls = 0;
+	for (int i = 0; i < 500 && (4 > num_reads || 20 > num_stable_polls); ++i)
+	{
+		Sleep(10);
+		LONG reads = 0;
+		for (int j = 0; j < num_pairs; ++j)
+			reads += sources[j]->mReadOpens;
+		num_stable_polls = reads == num_reads ? num_stable_polls + 1 : 0;
+		num_reads = reads;
+	}
+	CHECK(4 == num_reads);
+	AcquireSRWLockExclusive(&gWriteQueueLock);
+	const DWORD num_queued = gWriteQueueSize;
+	ReleaseSRWLockExclusive(&gWriteQueueLock);
+	CHECK(1 == num_queued);
+
+	SetEvent(write_gate);
+	StopTestWorkers();
+	CloseHandle(write_gate);
+	for (int i = 0; i < num_pairs; ++i)
+	{
+		CHECK(1 == sources[i]->mReadOpens);
+		CHECK(1 == targets[i]->mWriteOpens);
+		CHECK(1 == targets[i]->mCommits);
+		CHECK(EqualProperties(*sources[i], *targets[i]));
+	}
+}
+
+// -watch leaves a target alone while a pair for it is queued or running, and only for that target
+void TestWatchInFlight()
+{
+	const HANDLE write_gate = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	CHECK(nullptr != write_gate);
+	FakeFile &source = *CreateFakeFile('s', 0);
+	FakeFile &target = *CreateFakeFile('t', 0);
+	FakeFile &other_target = *CreateFakeFile('t', 1);
+	AddSourceProperties(source, 0);
+	target.mWriteGate = write_gate;
+	CHECK(StartWorkers(1, 0, 0));
+	if (nullptr == gJobs)
+	{
+		CloseHandle(write_gate);
+		return;
+	}
+
+	RunTestPair(source, target);
+	CHECK(IsTargetInFlight(target.mPath, lstrlenW(target.mPath)));
+	CHECK(!IsTargetInFlight(other_target.mPath, lstrlenW(other_target.mPath)));
+	SetEvent(write_gate);
+	for (int i = 0; i < 500 && IsTargetInFlight(target.mPath, lstrlenW(target.mPath)); ++i)
+		Sleep(10);
+	CHECK(!IsTargetInFlight(target.mPath, lstrlenW(target.mPath)));
+	StopTestWorkers();
+	CloseHandle(write_gate);
+	CHECK(1 == target.mCommits);
+}
+
+// Values of the kinds the containers store differently: text, numbers, lists, keys without a standard tag and dates
+constexpr int cTestPropertyIndices[] =
+{
+	GetPropertyIndex(2, 38), GetPropertyIndex(2, 5), GetPropertyIndex(3, 23), GetPropertyIndex(3, 15), GetPropertyIndex(1, 100)
+};
+
+wchar_t gTestSubTitle[] = L"Sub title";
+wchar_t gTestWriter1[] = L"Writer";
+wchar_t gTestWriter2[] = L"\x00C9crivain";
+LPWSTR gTestWriters[] = {gTestWriter1, gTestWriter2};
+wchar_t gTestDvdId[] = L"DVD 1";
+wchar_t gTestLongSubTitle[] = L"A sub title long enough that the moov does not fit where the last commit put it";
+
+// Returns a value that points into the globals above, so it is never cleared
+PROPVARIANT GetTestValue(int index)
+{
+	PROPVARIANT value = {};
+	switch (index)
+	{
+	case 0:
+		value.vt = VT_LPWSTR;
+		value.pwszVal = gTestSubTitle;
+		break;
+	case 1:
+		value.vt = VT_UI4;
+		value.ulVal = 2018;
+		break;
+	case 2:
+		value.vt = VT_VECTOR | VT_LPWSTR;
+		value.calpwstr.cElems = GetNumElements(gTestWriters);
+		value.calpwstr.pElems = gTestWriters;
+		break;
+	case 3:
+		value.vt = VT_LPWSTR;
+		value.pwszVal = gTestDvdId;
+		break;
+	default:
+		ULARGE_INTEGER time;
+		time.QuadPart = cTestDate;
+		value.vt = VT_FILETIME;
+		value.filetime.dwHighDateTime = time.HighPart;
+		value.filetime.dwLowDateTime = time.LowPart;
+		break;
+	}
+	return value;
+}
+
+void SetTestValues(IPropertyStore *store)
+{
+	for (int i = 0; i < GetNumElements(cTestPropertyIndices); ++i)
+	{
+		const PROPVARIANT value = GetTestValue(i);
+		CHECK(SUCCEEDED(store->SetValue(gDefaultPropertyTable.mKeys[cTestPropertyIndices[i]], value)));
+	}
+}
+
+bool EqualTestValue(const PROPVARIANT &value, int index)
+{
+	const PROPVARIANT expected = GetTestValue(index);
+	return expected.vt == value.vt && 0 == PropVariantCompareEx(value, expected, PVCU_DEFAULT, PVCF_CASESENSITIVE);
+}
+
+void CheckTestValues(IPropertyStore *store)
+{
+	DWORD count = 0;
+	CHECK(SUCCEEDED(store->GetCount(&count)) && GetNumElements(cTestPropertyIndices) == count);
+	for (int i = 0; i < GetNumElements(cTestPropertyIndices); ++i)
+	{
+		PROPVARIANT value = {};
+		CHECK(SUCCEEDED(store->GetValue(gDefaultPropertyTable.mKeys[cTestPropertyIndices[i]], &value)));
+		CHECK(EqualTestValue(value, i));
+		PropVariantClear(&value);
+	}
+}
+
+template<typename T>
+IPropertyStore *OpenTestStore(const wchar_t *path, GETPROPERTYSTOREFLAGS flags)
+{
+	IPropertyStore *store;
+	return SUCCEEDED(CreateNativePropertyStore<T>(path, flags, &store)) ? store : nullptr;
+}
+
+// Writes the test values into the file and reads them back from it
+template<typename T>
+void CheckRoundTrip(const wchar_t *path)
+{
+	IPropertyStore *store = OpenTestStore<T>(path, GPS_READWRITE);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	SetTestValues(store);
+	CHECK(SUCCEEDED(store->Commit()));
+	store->Release();
+
+	store = OpenTestStore<T>(path, GPS_DEFAULT);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	CheckTestValues(store);
+	store->Release();
+}
+
+// Returns the offset of the bytes in the data, or MAXDWORD
+DWORD FindTestBytes(const BYTE *data, DWORD size, const void *bytes, DWORD bytes_size)
+{
+	for (DWORD offset = 0; bytes_size <= size - offset && offset < size; ++offset)
+	{
+		DWORD i = 0;
+		while (i < bytes_size && data[offset + i] == static_cast<const BYTE *>(bytes)[i])
+			++i;
+		if (bytes_size == i)
+			return offset;
+	}
+	return MAXDWORD;
+}
+
+// The media of the test files is a pattern, so any byte moved or overwritten shows
+void PutTestMedia(ByteWriter &writer, DWORD size)
+{
+	for (DWORD i = 0; i < size; ++i)
+	{
+		const BYTE value = static_cast<BYTE>(i * 7 + 1);
+		writer.Put(&value, 1);
+	}
+}
+
+bool HasTestMedia(const BYTE *data, DWORD size, DWORD offset, DWORD media_size)
+{
+	if (size < offset || size - offset < media_size)
+		return false;
+	for (DWORD i = 0; i < media_size; ++i)
+	{
+		if (static_cast<BYTE>(i * 7 + 1) != data[offset + i])
+			return false;
+	}
+	return true;
+}
+
+void PutTestBox(ByteWriter &writer, DWORD size, const char (&type)[5])
+{
+	writer.PutU32(size);
+	writer.PutU32(MakeBoxType(type));
+}
+
+void PutTestFtyp(ByteWriter &writer)
+{
+	PutTestBox(writer, 16, "ftyp");
+	writer.PutU32(MakeBoxType("isom"));
+	writer.PutU32(0);
+}
+
+// A moov with a single track, whose only chunk is at chunk_offset
+void PutTestMoov(ByteWriter &writer, DWORD chunk_offset)
+{
+	PutTestBox(writer, cTestMoovSize, "moov");
+	PutTestBox(writer, cTestMoovSize - 8, "trak");
+	PutTestBox(writer, cTestMoovSize - 16, "mdia");
+	PutTestBox(writer, cTestMoovSize - 24, "minf");
+	PutTestBox(writer, cTestMoovSize - 32, "stbl");
+	PutTestBox(writer, cTestMoovSize - 40, "stco");
+	writer.PutU32(0);
+	writer.PutU32(1);
+	writer.PutU32(chunk_offset);
+}
+
+void PutTestMdat(ByteWriter &writer)
+{
+	PutTestBox(writer, 8 + cTestMediaSize, "mdat");
+	PutTestMedia(writer, cTestMediaSize);
+}
+
+// Returns the chunk offset of the track in the whole file, or 0
+DWORD GetTestChunkOffset(const BYTE *data, DWORD size)
+{
+	DWORD box = FindChildBox(data, 0, size, cBoxMoov);
+	const DWORD types[] = {cBoxTrak, cBoxMdia, cBoxMinf, cBoxStbl, cBoxStco};
+	for (int i = 0; box && i < GetNumElements(types); ++i)
+		box = FindChildBox(data, box + 8, box + ReadU32(data + box), types[i]);
+	return box ? ReadU32(data + box + 16) : 0;
+}
+
+// Values larger than the arena and BSTRs are held by the job as well, and the pair gives back what it took
+// above cArenaRetainSize
+void TestArenaLargeValues()
+{
+	Job &job = *BeginJob();
+	constexpr DWORD blob_size = cJobArenaSize + 1;
+	PROPVARIANT &blob = job.mPropertyValues[0];
+	blob.vt = VT_BLOB;
+	blob.blob.cbSize = blob_size;
+	blob.blob.pBlobData = static_cast<BYTE *>(CoTaskMemAlloc(blob.blob.cbSize));
+	CHECK(nullptr != blob.blob.pBlobData);
+	if (nullptr == blob.blob.pBlobData)
+		return;
+	for (DWORD i = 0; i < blob.blob.cbSize; ++i)
+		blob.blob.pBlobData[i] = static_cast<BYTE>(i * 7 + 1);
+	KeepPropertyValue(job, 0);
+	CHECK(job.mArenaValues[0] && nullptr != job.mArena.mLargeBlocks);
+	CHECK(HasTestMedia(blob.blob.pBlobData, blob.blob.cbSize, 0, blob.blob.cbSize));
+
+	const int length = lstrlenW(gTestSubTitle);
+	PROPVARIANT &text = job.mPropertyValues[1];
+	text.vt = VT_BSTR;
+	text.bstrVal = SysAllocStringLen(gTestSubTitle, length);
+	KeepPropertyValue(job, 1);
+	CHECK(job.mArenaValues[1] && static_cast<UINT>(length) == SysStringLen(text.bstrVal) && 0 == lstrcmp(gTestSubTitle, text.bstrVal));
+
+	// Half the arena commits more than it keeps
+	CHECK(nullptr != job.mArena.Allocate(cJobArenaSize / 2));
+	job.mStats.mJobBytes = 0;
+	ClearPropertyValues(job);
+	CHECK(VT_EMPTY == blob.vt && VT_EMPTY == text.vt);
+	CHECK(nullptr == job.mArena.mLargeBlocks && 0 == job.mArena.mLargeSize && cArenaRetainSize == job.mArena.mCommitSize);
+	CHECK(sizeof(Job) + cJobArenaSize / 2 + blob_size < job.mStats.mJobBytes);
+}
+
+// The values fit into the free box after the moov, so the media stays where it is
+void TestMp4RoundTrip()
+{
+	ByteWriter writer = {gTestFileData, 0};
+	PutTestFtyp(writer);
+	const DWORD media_offset = writer.mSize + 8;
+	PutTestMdat(writer);
+	PutTestMoov(writer, media_offset);
+	PutTestBox(writer, 8 + 2048, "free");
+	ZeroBytes(gTestFileData + writer.mSize, 2048);
+	writer.mSize += 2048;
+	const DWORD size = writer.mSize;
+	const wchar_t *path = CreateTestFile('m', 0, gTestFileData, size);
+
+	CheckRoundTrip<Mp4PropertyStore>(path);
+	CHECK(size == ReadTestFile(path, gTestFileData, cMaxTestFileSize));
+	CHECK(media_offset == GetTestChunkOffset(gTestFileData, size));
+	CHECK(HasTestMedia(gTestFileData, size, media_offset, cTestMediaSize));
+	// The year and the writers go into standard items, the others into own ones
+	CHECK(MAXDWORD != FindTestBytes(gTestFileData, size, "\xA9" "day", 4));
+	CHECK(MAXDWORD != FindTestBytes(gTestFileData, size, "\xA9" "wrt", 4));
+	DWORD num_own_items = 0;
+	for (DWORD offset = 0; offset < size; ++offset)
+	{
+		const DWORD item = FindTestBytes(gTestFileData + offset, size - offset, "----", 4);
+		if (MAXDWORD == item)
+			break;
+		++num_own_items;
+		offset += item;
+	}
+	CHECK(3 == num_own_items);
+}
+
+// Standard items of other tools are read, and those of the properties that are set are replaced
+void TestMp4StandardItems()
+{
+	ByteWriter writer = {gTestFileData, 0};
+	PutTestFtyp(writer);
+	const DWORD moov = writer.mSize;
+	PutTestMoov(writer, 0);
+	const DWORD udta = writer.mSize;
+	PutTestBox(writer, 0, "udta");
+	PutTestBox(writer, 0, "meta");
+	writer.PutU32(0);
+	const DWORD ilst = writer.mSize;
+	PutTestBox(writer, 0, "ilst");
+	PutTestBox(writer, 8 + 16 + 4, "tvsh");
+	PutTestBox(writer, 16 + 4, "data");
+	writer.PutU32(cMp4DataUtf8);
+	writer.PutU32(0);
+	writer.Put("Show", 4);
+	PutTestBox(writer, 8 + 16 + 4, "tvsn");
+	PutTestBox(writer, 16 + 4, "data");
+	writer.PutU32(cMp4DataInteger);
+	writer.PutU32(0);
+	writer.PutU32(3);
+	PutTestBox(writer, 8 + 2 * 16 + 2, "\xA9" "wrt");
+	PutTestBox(writer, 16 + 1, "data");
+	writer.PutU32(cMp4DataUtf8);
+	writer.PutU32(0);
+	writer.Put("A", 1);
+	PutTestBox(writer, 16 + 1, "data");
+	writer.PutU32(cMp4DataUtf8);
+	writer.PutU32(0);
+	writer.Put("B", 1);
+	PutTestBox(writer, 8 + 16 + 4, "\xA9" "nam");
+	PutTestBox(writer, 16 + 4, "data");
+	writer.PutU32(cMp4DataUtf8);
+	writer.PutU32(0);
+	writer.Put("Name", 4);
+	PutTestBox(writer, 8 + 16 + 20, "\xA9" "day");
+	PutTestBox(writer, 16 + 20, "data");
+	writer.PutU32(cMp4DataUtf8);
+	writer.PutU32(0);
+	writer.Put("2016-05-03T10:00:00Z", 20);
+	WriteU32(gTestFileData + ilst, writer.mSize - ilst);
+	WriteU32(gTestFileData + udta + 8, writer.mSize - udta - 8);
+	WriteU32(gTestFileData + udta, writer.mSize - udta);
+	WriteU32(gTestFileData + moov, writer.mSize - moov);
+	PutTestBox(writer, 8 + 1024, "free");
+	ZeroBytes(gTestFileData + writer.mSize, 1024);
+	writer.mSize += 1024;
+	const wchar_t *path = CreateTestFile('m', 0, gTestFileData, writer.mSize);
+
+	IPropertyStore *store = OpenTestStore<Mp4PropertyStore>(path, GPS_READWRITE);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	DWORD count = 0;
+	CHECK(SUCCEEDED(store->GetCount(&count)) && 4 == count);
+	PROPVARIANT value = {};
+	CHECK(SUCCEEDED(store->GetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(3, 42)], &value)) &&
+		VT_LPWSTR == value.vt && 0 == lstrcmp(L"Show", value.pwszVal));
+	PropVariantClear(&value);
+	CHECK(SUCCEEDED(store->GetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(3, 101)], &value)) && VT_UI4 == value.vt && 3 == value.ulVal);
+	CHECK(SUCCEEDED(store->GetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(3, 23)], &value)) &&
+		VT_VECTOR == (VT_VECTOR & value.vt) && 2 == value.calpwstr.cElems && 0 == lstrcmp(L"B", value.calpwstr.pElems[1]));
+	PropVariantClear(&value);
+	// The year is the start of the date
+	CHECK(SUCCEEDED(store->GetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(2, 5)], &value)) && VT_UI4 == value.vt && 2016 == value.ulVal);
+
+	const PROPVARIANT writers = GetTestValue(2);
+	CHECK(SUCCEEDED(store->SetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(3, 23)], writers)));
+	const PROPVARIANT year = GetTestValue(1);
+	CHECK(SUCCEEDED(store->SetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(2, 5)], year)));
+	CHECK(SUCCEEDED(store->Commit()));
+	store->Release();
+
+	store = OpenTestStore<Mp4PropertyStore>(path, GPS_DEFAULT);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	CHECK(SUCCEEDED(store->GetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(3, 23)], &value)) && EqualTestValue(value, 2));
+	PropVariantClear(&value);
+	CHECK(SUCCEEDED(store->GetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(2, 5)], &value)) && EqualTestValue(value, 1));
+	store->Release();
+	const DWORD size = ReadTestFile(path, gTestFileData, cMaxTestFileSize);
+	CHECK(MAXDWORD != FindTestBytes(gTestFileData, size, "Name", 4));
+	// Only the year of the date is replaced
+	CHECK(MAXDWORD != FindTestBytes(gTestFileData, size, "2018-05-03T10:00:00Z", 20));
+	CHECK(MAXDWORD == FindTestBytes(gTestFileData, size, "----", 4));
+}
+
+// Values that do not fit before the media move it, and the chunk offsets follow
+void TestMp4Rewrite()
+{
+	ByteWriter writer = {gTestFileData, 0};
+	PutTestFtyp(writer);
+	PutTestMoov(writer, writer.mSize + cTestMoovSize + 8);
+	PutTestMdat(writer);
+	const wchar_t *path = CreateTestFile('m', 0, gTestFileData, writer.mSize);
+
+	CheckRoundTrip<Mp4PropertyStore>(path);
+	const DWORD size = ReadTestFile(path, gTestFileData, cMaxTestFileSize);
+	const DWORD mdat = FindChildBox(gTestFileData, 0, size, cBoxMdat);
+	CHECK(0 != mdat && mdat + 8 == GetTestChunkOffset(gTestFileData, size));
+	CHECK(HasTestMedia(gTestFileData, size, mdat + 8, cTestMediaSize));
+}
+
+// Commits twice on one store, the second time with a value that makes the moov grow again
+void CheckCommitTwice(const wchar_t *path)
+{
+	IPropertyStore *store = OpenTestStore<Mp4PropertyStore>(path, GPS_READWRITE);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	SetTestValues(store);
+	CHECK(SUCCEEDED(store->Commit()));
+	PROPVARIANT value = {};
+	value.vt = VT_LPWSTR;
+	value.pwszVal = gTestLongSubTitle;
+	CHECK(SUCCEEDED(store->SetValue(gDefaultPropertyTable.mKeys[cTestPropertyIndices[0]], value)));
+	CHECK(SUCCEEDED(store->Commit()));
+	store->Release();
+
+	store = OpenTestStore<Mp4PropertyStore>(path, GPS_DEFAULT);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	CHECK(SUCCEEDED(store->GetValue(gDefaultPropertyTable.mKeys[cTestPropertyIndices[0]], &value)) &&
+		VT_LPWSTR == value.vt && 0 == lstrcmp(gTestLongSubTitle, value.pwszVal));
+	PropVariantClear(&value);
+	CHECK(SUCCEEDED(store->GetValue(gDefaultPropertyTable.mKeys[cTestPropertyIndices[2]], &value)) && EqualTestValue(value, 2));
+	PropVariantClear(&value);
+	store->Release();
+
+	const DWORD size = ReadTestFile(path, gTestFileData, cMaxTestFileSize);
+	const DWORD moov = FindChildBox(gTestFileData, 0, size, cBoxMoov);
+	CHECK(0 != moov && 0 == FindChildBox(gTestFileData, moov + ReadU32(gTestFileData + moov), size, cBoxMoov));
+	const DWORD mdat = FindChildBox(gTestFileData, 0, size, cBoxMdat);
+	CHECK(0 != mdat && mdat + 8 == GetTestChunkOffset(gTestFileData, size));
+	CHECK(HasTestMedia(gTestFileData, size, mdat + 8, cTestMediaSize));
+}
+
+// A second Commit on a store starts from the file that the first one wrote, whether it moved the media or
+// grew the moov at the end of the file
+void TestMp4CommitTwice()
+{
+	const int padding = gPadding;
+	gPadding = 0;
+	ByteWriter writer = {gTestFileData, 0};
+	PutTestFtyp(writer);
+	PutTestMoov(writer, writer.mSize + cTestMoovSize + 8);
+	PutTestMdat(writer);
+	CheckCommitTwice(CreateTestFile('m', 0, gTestFileData, writer.mSize));
+
+	writer.mSize = 0;
+	PutTestFtyp(writer);
+	PutTestMdat(writer);
+	PutTestMoov(writer, 16 + 8);
+	PutTestBox(writer, 8, "uuid");
+	CheckCommitTwice(CreateTestFile('m', 1, gTestFileData, writer.mSize));
+	gPadding = padding;
+}
+
+// Broken boxes fail the open, and a broken item is left out
+void TestMp4Malformed()
+{
+	ByteWriter writer = {gTestFileData, 0};
+	PutTestFtyp(writer);
+	PutTestBox(writer, 4, "free");
+	PutTestMoov(writer, 0);
+	CHECK(nullptr == OpenTestStore<Mp4PropertyStore>(CreateTestFile('m', 0, gTestFileData, writer.mSize), GPS_DEFAULT));
+
+	writer.mSize = 0;
+	PutTestFtyp(writer);
+	PutTestMoov(writer, 0);
+	PutTestBox(writer, 8 + cTestMediaSize, "mdat");
+	CHECK(nullptr == OpenTestStore<Mp4PropertyStore>(CreateTestFile('m', 1, gTestFileData, writer.mSize), GPS_DEFAULT));
+
+	writer.mSize = 0;
+	PutTestFtyp(writer);
+	PutTestMdat(writer);
+	CHECK(nullptr == OpenTestStore<Mp4PropertyStore>(CreateTestFile('m', 2, gTestFileData, writer.mSize), GPS_DEFAULT));
+
+	writer.mSize = 0;
+	PutTestFtyp(writer);
+	PutTestMoov(writer, 0);
+	PutTestBox(writer, 8 + 1024, "free");
+	ZeroBytes(gTestFileData + writer.mSize, 1024);
+	writer.mSize += 1024;
+	const wchar_t *path = CreateTestFile('m', 3, gTestFileData, writer.mSize);
+	IPropertyStore *store = OpenTestStore<Mp4PropertyStore>(path, GPS_READWRITE);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	const PROPVARIANT value = GetTestValue(0);
+	CHECK(SUCCEEDED(store->SetValue(gDefaultPropertyTable.mKeys[cTestPropertyIndices[0]], value)));
+	CHECK(SUCCEEDED(store->Commit()));
+	store->Release();
+
+	// The data box of the item claims more than the item holds
+	const DWORD size = ReadTestFile(path, gTestFileData, cMaxTestFileSize);
+	const DWORD data = FindTestBytes(gTestFileData, size, "data", 4);
+	CHECK(MAXDWORD != data);
+	if (MAXDWORD == data)
+		return;
+	WriteU32(gTestFileData + data - 4, ReadU32(gTestFileData + data - 4) + 100);
+	store = OpenTestStore<Mp4PropertyStore>(CreateTestFile('m', 4, gTestFileData, size), GPS_DEFAULT);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	DWORD count = 1;
+	CHECK(SUCCEEDED(store->GetCount(&count)) && 0 == count);
+	store->Release();
+}
+
+// Puts the EBML header, then a Segment with a SeekHead pointing at Info, the Void that Tags go into, Info with
+// room to grow and a Cluster of media. Returns the offset of the segment size
+DWORD PutTestMkv(ByteWriter &writer, bool has_seek_head, DWORD void_size)
+{
+	PutEbmlHeader(writer, cEbmlIdHeader, 11);
+	PutEbmlElement(writer, cTestEbmlIdDocType, "matroska", 8);
+	PutEbmlId(writer, cMkvIdSegment);
+	const DWORD segment_size_offset = writer.mSize;
+	PutEbmlSize(writer, 0, 2);
+	const DWORD segment_offset = writer.mSize;
+
+	DWORD position_offset = 0;
+	if (has_seek_head)
+	{
+		PutEbmlHeader(writer, cMkvIdSeekHead, 21);
+		PutEbmlHeader(writer, cMkvIdSeek, 18);
+		PutEbmlUnsigned(writer, cMkvIdSeekId, cMkvIdInfo, 4);
+		position_offset = writer.mSize + 3;
+		PutEbmlUnsigned(writer, cMkvIdSeekPosition, 0, 8);
+	}
+
+	if (void_size)
+	{
+		PutEbmlHeader(writer, cEbmlIdVoid, void_size);
+		ZeroBytes(writer.mData + writer.mSize, void_size);
+		writer.mSize += void_size;
+	}
+
+	if (has_seek_head)
+		WriteU64(writer.mData + position_offset, writer.mSize - segment_offset);
+	PutEbmlHeader(writer, cMkvIdInfo, 7);
+	PutEbmlUnsigned(writer, cTestMkvIdTimecodeScale, 1000000, 3);
+	PutEbmlHeader(writer, cEbmlIdVoid, 100);
+	ZeroBytes(writer.mData + writer.mSize, 100);
+	writer.mSize += 100;
+
+	PutEbmlHeader(writer, cMkvIdCluster, cTestMediaSize);
+	PutTestMedia(writer, cTestMediaSize);
+
+	ByteWriter size_writer = {writer.mData + segment_size_offset, 0};
+	PutEbmlSize(size_writer, writer.mSize - segment_offset, 2);
+	return segment_size_offset;
+}
+
+// The date goes into Info, the mapped values into their Matroska tags and the rest into own tags, all without
+// touching the cluster
+void TestMkvRoundTrip()
+{
+	ByteWriter writer = {gTestFileData, 0};
+	PutTestMkv(writer, true, cTestMkvVoidSize);
+	const wchar_t *path = CreateTestFile('k', 0, gTestFileData, writer.mSize);
+
+	CheckRoundTrip<MkvPropertyStore>(path);
+	const DWORD size = ReadTestFile(path, gTestFileData, cMaxTestFileSize);
+	const BYTE cluster_id[] = {0x1F, 0x43, 0xB6, 0x75};
+	const DWORD cluster = FindTestBytes(gTestFileData, size, cluster_id, sizeof(cluster_id));
+	CHECK(MAXDWORD != cluster && HasTestMedia(gTestFileData, size, cluster + sizeof(cluster_id) + 1, cTestMediaSize));
+}
+
+// A file without a SeekHead gets one in its Void, followed by the Tags, and the same store commits again where they
+// went
+void TestMkvWithoutSeekHead()
+{
+	ByteWriter writer = {gTestFileData, 0};
+	PutTestMkv(writer, false, cTestMkvVoidSize);
+	const wchar_t *path = CreateTestFile('k', 0, gTestFileData, writer.mSize);
+
+	CheckRoundTrip<MkvPropertyStore>(path);
+	DWORD size = ReadTestFile(path, gTestFileData, cMaxTestFileSize);
+	CHECK(writer.mSize == size);
+	const BYTE seek_head_id[] = {0x11, 0x4D, 0x9B, 0x74};
+	CHECK(MAXDWORD != FindTestBytes(gTestFileData, size, seek_head_id, sizeof(seek_head_id)));
+
+	IPropertyStore *store = OpenTestStore<MkvPropertyStore>(path, GPS_READWRITE);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	PROPVARIANT value = {};
+	value.vt = VT_LPWSTR;
+	value.pwszVal = gTestDvdId;
+	CHECK(SUCCEEDED(store->SetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(2, 38)], value)));
+	CHECK(SUCCEEDED(store->Commit()));
+	value.pwszVal = gTestSubTitle;
+	CHECK(SUCCEEDED(store->SetValue(gDefaultPropertyTable.mKeys[GetPropertyIndex(2, 38)], value)));
+	CHECK(SUCCEEDED(store->Commit()));
+	store->Release();
+
+	store = OpenTestStore<MkvPropertyStore>(path, GPS_DEFAULT);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	CheckTestValues(store);
+	store->Release();
+	size = ReadTestFile(path, gTestFileData, cMaxTestFileSize);
+	CHECK(writer.mSize == size);
+}
+
+// When the Tags fit nowhere, the commit fails and Info is written back as it was
+void TestMkvRollBack()
+{
+	ByteWriter writer = {gTestFileData, 0};
+	PutTestMkv(writer, true, 0);
+	// Data after the segment keeps it from growing at the end of the file
+	PutTestMedia(writer, 16);
+	const DWORD size = writer.mSize;
+	const wchar_t *path = CreateTestFile('k', 0, gTestFileData, size);
+
+	IPropertyStore *store = OpenTestStore<MkvPropertyStore>(path, GPS_READWRITE);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	SetTestValues(store);
+	CHECK(FAILED(store->Commit()));
+	store->Release();
+
+	store = OpenTestStore<MkvPropertyStore>(path, GPS_DEFAULT);
+	CHECK(nullptr != store);
+	if (nullptr == store)
+		return;
+	DWORD count = 1;
+	CHECK(SUCCEEDED(store->GetCount(&count)) && 0 == count);
+	store->Release();
+	CHECK(size == ReadTestFile(path, gTestFileData, cMaxTestFileSize));
+}
+
+// Broken element headers fail the open, and a child larger than its parent is not read
+void TestMkvMalformed()
+{
+	const BYTE invalid_id[] = {0x00, 0x81, 0x00};
+	CHECK(nullptr == OpenTestStore<MkvPropertyStore>(CreateTestFile('k', 0, invalid_id, sizeof(invalid_id)), GPS_DEFAULT));
+
+	ByteWriter writer = {gTestFileData, 0};
+	const DWORD segment_size_offset = PutTestMkv(writer, true, cTestMkvVoidSize);
+	ByteWriter size_writer = {gTestFileData + segment_size_offset, 0};
+	PutEbmlSize(size_writer, writer.mSize, 2);
+	CHECK(nullptr == OpenTestStore<MkvPropertyStore>(CreateTestFile('k', 1, gTestFileData, writer.mSize), GPS_DEFAULT));
+
+	// The EBML header has to have a known size, as the segment is found after it
+	writer.mSize = 0;
+	PutTestMkv(writer, true, cTestMkvVoidSize);
+	gTestFileData[4] = 0xFF;
+	CHECK(nullptr == OpenTestStore<MkvPropertyStore>(CreateTestFile('k', 2, gTestFileData, writer.mSize), GPS_DEFAULT));
+
+	const BYTE doc_type[] = {0x42, 0x82, 0x85, 'a', 'b'};
+	EbmlElement element;
+	CHECK(!ReadEbmlElement(doc_type, 0, sizeof(doc_type), &element));
+	const BYTE long_id[] = {0x08, 0x00, 0x00, 0x00, 0x00, 0x80};
+	CHECK(!ReadEbmlElement(long_id, 0, sizeof(long_id), &element));
+}
+
+// Exports a record for each of the sources, with the test values and a year of its own
+void ExportTestSnapshots(int num_sources)
+{
+	CHECK(StartExport());
+	for (int i = 0; i < num_sources; ++i)
+	{
+		Job &job = *BeginJob();
+		wchar_t path[MAX_PATH];
+		GetTestPath(path, 's', i);
+		CHECK(SetFullPath(job, FR_SRC, path));
+		job.mCreationTime.dwHighDateTime = i;
+		job.mCreationTime.dwLowDateTime = 1;
+		job.mLastWriteTime.dwHighDateTime = i;
+		job.mLastWriteTime.dwLowDateTime = 2;
+		job.mSourceSize = 0x100000000ULL + i;
+		for (int j = 0; j < GetNumElements(cTestPropertyIndices); ++j)
+		{
+			const PROPVARIANT value = GetTestValue(j);
+			CHECK(SUCCEEDED(PropVariantCopy(&job.mPropertyValues[cTestPropertyIndices[j]], &value)));
+		}
+		job.mPropertyValues[cTestPropertyIndices[1]].ulVal = 2000 + i;
+		CHECK(ExportSnapshot(job));
+		ClearPropertyValues(job);
+	}
+	CHECK(FinishExport());
+}
+
+// Imports the source of the job from the pack in the file, and unmaps the pack again
+bool ImportTestSnapshot(const wchar_t *pack_path, int number)
+{
+	gImportName = pack_path;
+	const bool mapped = MapSnapshotPack();
+	Job &job = *BeginJob();
+	wchar_t path[MAX_PATH];
+	GetTestPath(path, 's', number);
+	const bool result = mapped && SetFullPath(job, FR_SRC, path) && ImportSnapshot(job);
+	ClearPropertyValues(job);
+	if (gSnapshotView)
+		UnmapViewOfFile(gSnapshotView);
+	gSnapshotView = nullptr;
+	gImportName = nullptr;
+	return result;
+}
+
+// Each source finds its own record in the pack, and a source that was not exported finds none
+void TestSnapshotRoundTrip()
+{
+	constexpr int num_sources = 3;
+	gExportName = CreateTestFile('p', 0, nullptr, 0);
+	ExportTestSnapshots(num_sources);
+	gExportName = nullptr;
+
+	gImportName = gTestFilePaths[gNumTestFiles - 1];
+	CHECK(MapSnapshotPack());
+	for (int i = 0; i < num_sources; ++i)
+	{
+		Job &job = *BeginJob();
+		wchar_t path[MAX_PATH];
+		GetTestPath(path, 's', i);
+		CHECK(SetFullPath(job, FR_SRC, path) && ImportSnapshot(job));
+		FileStamp stamp;
+		CHECK(GetSourceStamp(job, &stamp) && (static_cast<ULONGLONG>(i) << 32 | 2) == stamp.mLastWriteTime);
+		CHECK(0x100000000ULL + i == stamp.mSize && stamp.mSize == job.mSourceSize);
+		CHECK(static_cast<DWORD>(i) == job.mCreationTime.dwHighDateTime && 1 == job.mCreationTime.dwLowDateTime);
+		CHECK(static_cast<DWORD>(i) == job.mLastWriteTime.dwHighDateTime && 2 == job.mLastWriteTime.dwLowDateTime);
+		for (int j = 0; j < GetNumElements(cTestPropertyIndices); ++j)
+		{
+			if (1 == j)
+				CHECK(VT_UI4 == job.mPropertyValues[cTestPropertyIndices[j]].vt && static_cast<ULONG>(2000 + i) == job.mPropertyValues[cTestPropertyIndices[j]].ulVal);
+			else
+				CHECK(EqualTestValue(job.mPropertyValues[cTestPropertyIndices[j]], j));
+		}
+		ClearPropertyValues(job);
+	}
+	Job &job = *BeginJob();
+	wchar_t path[MAX_PATH];
+	GetTestPath(path, 's', num_sources);
+	CHECK(SetFullPath(job, FR_SRC, path) && !ImportSnapshot(job));
+	UnmapViewOfFile(gSnapshotView);
+	gSnapshotView = nullptr;
+	gImportName = nullptr;
+}
+
+// A value a record cannot hold fails the export of the pair, and is counted and reported
+void TestSnapshotUnsupportedValue()
+{
+	gExportName = CreateTestFile('p', 0, nullptr, 0);
+	CHECK(StartExport());
+	Job &job = *BeginJob();
+	wchar_t path[MAX_PATH];
+	GetTestPath(path, 's', 0);
+	CHECK(SetFullPath(job, FR_SRC, path));
+	const PROPVARIANT value = GetTestValue(0);
+	CHECK(SUCCEEDED(PropVariantCopy(&job.mPropertyValues[cTestPropertyIndices[0]], &value)));
+	job.mPropertyValues[cTestPropertyIndices[3]].vt = VT_VECTOR | VT_VARIANT;
+	job.mStats.mFailedKeys = 0;
+	const DWORD output_length = gOutputLength;
+	CHECK(!ExportSnapshot(job));
+	CHECK(1 == job.mStats.mFailedKeys);
+	CHECK(output_length + GetNumElements(cCannotExportUnknownProperty) - 1 == gOutputLength);
+	// Nor is such a source kept in the caches of -watch and -from
+	DWORD record_size;
+	CHECK(nullptr == PutSourceRecord(job, 0, &record_size));
+	ClearPropertyValues(job);
+	CHECK(FinishExport());
+	gExportName = nullptr;
+}
+
+// A broken header fails the mapping, and broken entries or records fail the lookup
+void TestSnapshotMalformed()
+{
+	gExportName = CreateTestFile('p', 0, nullptr, 0);
+	ExportTestSnapshots(1);
+	gExportName = nullptr;
+	const DWORD size = ReadTestFile(gTestFilePaths[gNumTestFiles - 1], gTestFileData, cMaxTestFileSize);
+	CHECK(cSnapshotHeaderSize < size);
+	CHECK(ImportTestSnapshot(gTestFilePaths[gNumTestFiles - 1], 0));
+
+	gTestFileData[0] ^= 1;
+	CHECK(!ImportTestSnapshot(CreateTestFile('p', 1, gTestFileData, size), 0));
+	gTestFileData[0] ^= 1;
+
+	const ULONGLONG index_offset = ReadU64(gTestFileData + 8);
+	WriteU64(gTestFileData + 8, size + cSnapshotAlignment);
+	CHECK(!ImportTestSnapshot(CreateTestFile('p', 2, gTestFileData, size), 0));
+	WriteU64(gTestFileData + 8, index_offset);
+
+	// The entry is chained to itself, with a hash that never matches
+	BYTE *entry = gTestFileData + index_offset + ReadU32(gTestFileData + 20) * sizeof(DWORD);
+	WriteU32(entry + 12, 1);
+	WriteU32(entry + 16, ReadU32(entry + 16) ^ 1);
+	CHECK(!ImportTestSnapshot(CreateTestFile('p', 3, gTestFileData, size), 0));
+	WriteU32(entry + 12, 0);
+	WriteU32(entry + 16, ReadU32(entry + 16) ^ 1);
+
+	WriteU32(entry + 8, 8);
+	CHECK(!ImportTestSnapshot(CreateTestFile('p', 4, gTestFileData, size), 0));
+}
+
+void CloseTestJournal()
+{
+	if (gJournalFile)
+		CloseHandle(gJournalFile);
+	gJournalFile = nullptr;
+	gJournalEntries.Dispose();
+	gJournalBuckets.Dispose();
+	gJournalSize = 0;
+}
+
+// Checks the pair of the source and target against the open journal
+bool IsTestPairJournaled(const wchar_t *source_path, const wchar_t *target_path)
+{
+	Job &job = *BeginJob();
+	return SetFullPath(job, FR_SRC, source_path) && SetFullPath(job, FR_DEST, target_path) && IsJournaled(job);
+}
+
+// A finished pair is skipped by the next run until its target changes, and a torn record is cut off
+void TestJournal()
+{
+	const BYTE data[] = {1, 2, 3};
+	const wchar_t *source_path = CreateTestFile('s', 0, data, 1);
+	const wchar_t *target_path = CreateTestFile('t', 0, data, 2);
+	gJournalName = CreateTestFile('j', 0, nullptr, 0);
+	CHECK(OpenJournal());
+	CHECK(!IsTestPairJournaled(source_path, target_path));
+	JournalPair(gSerialJob);
+	CloseTestJournal();
+
+	CHECK(OpenJournal());
+	CHECK(1 == gJournalEntries.mSize);
+	CHECK(IsTestPairJournaled(source_path, target_path));
+	CHECK(!IsTestPairJournaled(target_path, source_path));
+	CloseTestJournal();
+	CreateTestFile('t', 0, data, 3);
+	CHECK(OpenJournal());
+	CHECK(!IsTestPairJournaled(source_path, target_path));
+	CloseTestJournal();
+
+	const DWORD size = ReadTestFile(gJournalName, gTestFileData, cMaxTestFileSize);
+	CHECK(cJournalHeaderSize + cJournalRecordSize == size);
+	ZeroBytes(gTestFileData + size, 10);
+	gJournalName = CreateTestFile('j', 1, gTestFileData, size + 10);
+	CHECK(OpenJournal());
+	CHECK(1 == gJournalEntries.mSize);
+	CloseTestJournal();
+	CHECK(size == ReadTestFile(gJournalName, gTestFileData, cMaxTestFileSize));
+
+	gTestFileData[0] ^= 1;
+	gJournalName = CreateTestFile('j', 2, gTestFileData, size);
+	CHECK(!OpenJournal());
+	CHECK(nullptr == gJournalFile);
+	CloseTestJournal();
+	gJournalName = nullptr;
+}
+
+// Returns whether the output printed since the given length is the expected text
+template<int LENGTH>
+bool EqualOutput(DWORD output_length, const wchar_t (&expected)[LENGTH])
+{
+	return LENGTH - 1 == gOutputLength - output_length &&
+		CSTR_EQUAL == CompareStringOrdinal(gOutput + output_length, LENGTH - 1, expected, LENGTH - 1, FALSE);
+}
+
+// Under -log json an invalid manifest line and a missing source are records, and as text they keep their lines
+void TestLogRecords()
+{
+	const wchar_t *target_path = L"C:\\t.mp4";
+	gManifestName = L"pairs.txt";
+	gLogFormat = LF_JSON;
+	DWORD output_length = gOutputLength;
+	PrintManifestLineError(7);
+	CHECK(EqualOutput(output_length,
+		L"{\"level\":\"error\",\"phase\":\"pair\",\"file\":\"pairs.txt\",\"line\":7,\"hresult\":\"0x8007000D\",\"message\":\"Invalid manifest line\"}\n"));
+	output_length = gOutputLength;
+	PrintError(cNoSourceFor, SP_PAIR, target_path, HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND));
+	CHECK(EqualOutput(output_length,
+		L"{\"level\":\"error\",\"phase\":\"pair\",\"file\":\"C:\\\\t.mp4\",\"hresult\":\"0x80070002\",\"message\":\"No source for\"}\n"));
+
+	gLogFormat = LF_TEXT;
+	output_length = gOutputLength;
+	PrintManifestLineError(7);
+	PrintError(cNoSourceFor, SP_PAIR, target_path, HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND));
+	CHECK(EqualOutput(output_length, L"Invalid manifest line: 7\nNo source for: C:\\t.mp4\n"));
+	gManifestName = nullptr;
+}
+
+constexpr Test cTests[] =
+{
+	{L"OneCommitPerPair", TestOneCommitPerPair},
+	{L"OrderedCompletion", TestOrderedCompletion},
+	{L"QueueSaturation", TestQueueSaturation},
+	{L"WatchInFlight", TestWatchInFlight},
+	{L"ArenaLargeValues", TestArenaLargeValues},
+	{L"Mp4RoundTrip", TestMp4RoundTrip},
+	{L"Mp4StandardItems", TestMp4StandardItems},
+	{L"Mp4Rewrite", TestMp4Rewrite},
+	{L"Mp4CommitTwice", TestMp4CommitTwice},
+	{L"Mp4Malformed", TestMp4Malformed},
+	{L"MkvRoundTrip", TestMkvRoundTrip},
+	{L"MkvWithoutSeekHead", TestMkvWithoutSeekHead},
+	{L"MkvRollBack", TestMkvRollBack},
+	{L"MkvMalformed", TestMkvMalformed},
+	{L"SnapshotRoundTrip", TestSnapshotRoundTrip},
+	{L"SnapshotUnsupportedValue", TestSnapshotUnsupportedValue},
+	{L"SnapshotMalformed", TestSnapshotMalformed},
+	{L"Journal", TestJournal},
+	{L"LogRecords", TestLogRecords}
+};
+
+void TestEntry()
+{
+	gConsoleOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	// The output stays in the buffer until a test has looked at it
+	gOutputIsConsole = false;
+	gComInitialized = SUCCEEDED(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED));
+	gPropertyStoreBackend = &gFakePropertyStoreBackend;
+
+	gTestDirectoryLength = GetTempPath(GetNumElements(gTestDirectory) - GetNumElements(cTestDirectoryName) - 8, gTestDirectory);
+	if (0 == gTestDirectoryLength)
+	{
+		PrintA(cCannotCreateTestDirectory);
+		ExitProgram(1);
+	}
+	lstrcpyn(gTestDirectory + gTestDirectoryLength, cTestDirectoryName, GetNumElements(cTestDirectoryName));
+	gTestDirectoryLength += GetNumElements(cTestDirectoryName) - 1;
+	if (!CreateDirectory(gTestDirectory, nullptr) && ERROR_ALREADY_EXISTS != GetLastError())
+	{
+		PrintA(cCannotCreateTestDirectory);
+		ExitProgram(1);
+	}
+	gTestDirectory[gTestDirectoryLength++] = '\\';
+
+	for (int i = 0; i < GetNumElements(cTests); ++i)
+	{
+		gTestName = cTests[i].mName;
+		gTestFailed = false;
+		++gNumTests;
+		cTests[i].mRun();
+		DeleteTestFiles();
+		// The messages of the pairs are shown with the failures, as they may tell why
+		if (gTestFailed)
+			FlushOutput();
+		gOutputLength = 0;
+	}
+
+	gTestDirectory[gTestDirectoryLength - 1] = 0;
+	RemoveDirectory(gTestDirectory);
+
+	PrintA(cTestSummary);
+	PrintN(gNumTests);
+	PrintA(cTestFailedSummary);
+	PrintN(gNumFailedTests);
+	PrintA(cNewLine);
+	if (gComInitialized)
+		CoUninitialize();
+	ExitProgram(gNumFailedTests ? 1 : 0);
+}